@@ -1,12 +1,20 @@
+#define _GNU_SOURCE	// copy_file_range
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>	// FICLONE
+#endif
 #include <math.h>
 #include <time.h>
 #include <string.h>
 #include "set.h"
+#include "palettes.h"
 
-/* compile as gcc -m32 -g -o bmp bitmap.c setLinkedListImp.c -lm*/
+/* compile with make, palettes.c is generated by gentables */
 
 /********************************************************************************
  * 			    bitmap.c
@@ -36,10 +44,14 @@
  *			./bmp -extract outfile.bmp
  *
  *	Compile as 
- *		gcc -m32 -g -o bmp bitmap.c setLinkedListImp.c -lm
+ *		make
+ *	palettes.c is generated at build time by gentables, it holds
+ *	the lookup tables for standard palettes, see palettes.h.
  *
  *	Notes:
  *		'outfile.bmp' is the name of the stego-image produced when hiding.
+ *		It is cloned from the cover and only the changed pages are
+ *		written, see writeFile().
  *		'recovered' is the file name of the recovered payload.
  ***********************************************************************************/
 
@@ -80,32 +92,62 @@ typedef struct RGBQUAD{
 } RGBQUAD[];
 #pragma pack(pop)
 
+/*
+ * Lookup tables for the palette of the loaded image.
+ * nearest[i][b] is the closest entry to i with parity b, or -1
+ * if it has not been worked out yet. parity[i] is R+G+B mod 2.
+ */
+typedef struct PALETTETABLE{
+	int nearest[256][2];
+	unsigned char parity[256];
+} PALETTETABLE;
+
+/*
+ * Pages of the output file holding pixels that hideMessage() changed.
+ * Page n covers file bytes n * pageSize up to (n + 1) * pageSize,
+ * offset is where the pixel data starts in the file.
+ */
+typedef struct DIRTYMAP{
+	unsigned int offset;
+	unsigned int pageSize;
+	unsigned int pages;
+	unsigned char *page;	// 1 if the page has to be written
+} DIRTYMAP;
+
 /* Prototypes */
 unsigned char *loadBitMap( char *filename,
 		struct RGBQUAD c[256], 
 		struct BITMAPFILEHEADER *bmpFileHeader, 
-		struct BITMAPINFOHEADER *bmpInfoHeader);
+		struct BITMAPINFOHEADER *bmpInfoHeader,
+		struct PALETTETABLE *table);
 
 void printData( struct RGBQUAD c[256], 
 		struct BITMAPFILEHEADER bmpFileHeader, 
 		struct BITMAPINFOHEADER bmpInfoHeader);
 
-void writeFile( struct RGBQUAD c[256],
+void writeFile( char *cover,
+		struct RGBQUAD c[256],
 		struct BITMAPFILEHEADER bmpFileHeader,
 		struct BITMAPINFOHEADER bmpInfoheader,
-		unsigned char *bmpData);
+		unsigned char *bmpData,
+		struct DIRTYMAP *dirty);
+
+int cloneCover(char *cover, 
+	       char *outName);
 
 unsigned char *convertToBinary(char *filename, 
 			       int *size);
 
 unsigned char *hideMessage(struct RGBQUAD p[256], 
+			   struct PALETTETABLE *table,
+			   struct DIRTYMAP *dirty,
 			   unsigned char *cvrImg, 
 			   unsigned char *msgDataBin, 
 			   int msgSize, 
 			   unsigned int cvrSize);
 
 void extractPayload(unsigned char *bmpData, 
-		    struct RGBQUAD p[256], 
+		    struct PALETTETABLE *table, 
 		    int cvrSize);
 
 
@@ -123,6 +165,7 @@ int main(int argc, char *argv[]){
 	struct BITMAPFILEHEADER bmpFileHeader;
         struct BITMAPINFOHEADER bmpInfoHeader;
         struct RGBQUAD palette[256];
+        struct PALETTETABLE table;
         unsigned char *bmpData;
 
        	/* variable used for our hidden message */
@@ -150,18 +193,30 @@ int main(int argc, char *argv[]){
 		}
 
 		// load our cover image into memory
-        	bmpData = loadBitMap(argv[2], palette, &bmpFileHeader, &bmpInfoHeader);
+        	bmpData = loadBitMap(argv[2], palette, &bmpFileHeader, &bmpInfoHeader, &table);
 		// covert our payload to binary
         	msgDataBinary = convertToBinary(argv[3], &msgSizeBinary);
 
+		/* keep track of the pages of outfile.bmp that hiding changes */
+		struct DIRTYMAP dirty;
+		dirty.offset = sizeof(struct BITMAPFILEHEADER) + sizeof(struct BITMAPINFOHEADER) + 256 * sizeof(struct RGBQUAD);
+		dirty.pageSize = sysconf(_SC_PAGESIZE);
+		dirty.pages = (dirty.offset + bmpInfoHeader.biSizeImage + dirty.pageSize - 1) / dirty.pageSize;
+		dirty.page = (unsigned char *) calloc(dirty.pages, 1);
+		if(dirty.page == NULL){
+			fprintf(stderr, "Unable to allocate the dirty page map\n");
+			exit(-1);
+		}
+
         	unsigned char *newBmpData;
 		// hide the payload in the cover, returns a pointer to the altered bitmap data
 		// altered bitmap data has updated pixel indexes that reference new palette colors
-        	newBmpData = hideMessage(palette, bmpData, msgDataBinary, msgSizeBinary, bmpInfoHeader.biSizeImage);
+        	newBmpData = hideMessage(palette, &table, &dirty, bmpData, msgDataBinary, msgSizeBinary, bmpInfoHeader.biSizeImage);
 
 		//write the stego image to the file.
-       		writeFile(palette, bmpFileHeader, bmpInfoHeader, bmpData);
+       		writeFile(argv[2], palette, bmpFileHeader, bmpInfoHeader, bmpData, &dirty);
 	
+		free(dirty.page);
 		free(bmpData);
 		free(msgDataBinary);
 
@@ -170,9 +225,9 @@ int main(int argc, char *argv[]){
 	} else if( strcmp(argv[1], "-extract") == 0 && strcmp(argv[2], "outfile.bmp") == 0 && argc == 3){
 		
 		// load our stego image into memory
-		bmpData = loadBitMap(argv[2], palette, &bmpFileHeader, &bmpInfoHeader);
+		bmpData = loadBitMap(argv[2], palette, &bmpFileHeader, &bmpInfoHeader, &table);
 		// extract the payload and reassemble
-		extractPayload(bmpData, palette, bmpInfoHeader.biSizeImage);
+		extractPayload(bmpData, &table, bmpInfoHeader.biSizeImage);
 
 		free(bmpData);
 
@@ -186,16 +241,19 @@ int main(int argc, char *argv[]){
 	return 0;
 }
 
-unsigned char *hideMessage(struct RGBQUAD p[256], unsigned char *cvrImg, unsigned char *msgDataBin, int msgSize, unsigned int cvrSize){
+unsigned char *hideMessage(struct RGBQUAD p[256], struct PALETTETABLE *table, struct DIRTYMAP *dirty, unsigned char *cvrImg, unsigned char *msgDataBin, int msgSize, unsigned int cvrSize){
 	
 	srand((unsigned int) 76);
 	unsigned char r1, g1, b1, r2, g2, b2;
 	double close, tmp;
-	int palIndex, binIndex, pixel;
+	int palIndex, binIndex, newIndex;
+	unsigned int pixel;
 	int i; 
 	///////////////////////////////
-	int cacheOfIndex[256][2]; //Stores a cache of closest color indexs of both 0 parity and 1 parity.
-	memset(cacheOfIndex, -1, sizeof(cacheOfIndex));//Initialized to -1 to act as a null case.
+	//Stores a cache of closest color indexs of both 0 parity and 1 parity.
+	//loadBitMap() sets it up, unsolved entries are -1 to act as a null case.
+	//For a standard palette it is already complete and no sets are built.
+	int (*cacheOfIndex)[2] = table->nearest;
 	///////////////////////////////
 
 	
@@ -222,20 +280,28 @@ unsigned char *hideMessage(struct RGBQUAD p[256], unsigned char *cvrImg, unsigne
 	 */
 	// close = 0.0;
 	int pIndex[256] = {-1}; // used to set out pixel index to reference a new palette entry
-	int rgb; // used to calculate the parity bit used to hide our message
 
 	pixel = 0;
 	while( binIndex != msgSize) {
-		colorSet = setNew();
+		/* ran out of pixels, carrying on would write past the image and the dirty map */
+		if(pixel >= cvrSize){
+			fprintf(stderr, "The payload does not fit in the %u pixels of the cover image\n", cvrSize);
+			exit(-1);
+		}
 		//pixel = rand() % cvrSize;
 		///////////////////////////////////////
 		if (cacheOfIndex[cvrImg[pixel]][msgDataBin[binIndex]] != -1){ //Check if value has been solved already
-			cvrImg[pixel] = cacheOfIndex[cvrImg[pixel]][msgDataBin[binIndex]]; //If in cache use cached answer
+			newIndex = cacheOfIndex[cvrImg[pixel]][msgDataBin[binIndex]]; //If in cache use cached answer
+			if(cvrImg[pixel] != newIndex){ //Only a changed pixel has to be written out
+				cvrImg[pixel] = newIndex;
+				dirty->page[(dirty->offset + pixel) / dirty->pageSize] = 1;
+			}
 			binIndex++;		//Then move on to the next bit
 			pixel++;
 			continue; //Return to the top of the While Loop
 		}
 		///////////////////////////////////////
+		colorSet = setNew(); //Only built when the answer is not cached yet
 		//for(i = cvrImg[pixel]; i < 255; i++){ // i will need to equal the index of the pixel we're on
 		for(i = 0; i < 256; i++){ // It should iterate through every palette color, 
 					  // since it's just looking for the closest palette color palette-wise and 
@@ -269,8 +335,7 @@ unsigned char *hideMessage(struct RGBQUAD p[256], unsigned char *cvrImg, unsigne
 					  // inlcuding the closest which would be itself because if 
 					  // it matches the parity already we don't have to change it. 
 					  // That way the message bit still matches and it's even less detectable since we change nothing.
-			rgb = p[ pIndex[i] ].RED + p[ pIndex[i] ].GRN + p[ pIndex[i] ].BLU;
-			if( rgb % 2  == msgDataBin[binIndex] ){
+			if( table->parity[ pIndex[i] ] == msgDataBin[binIndex] ){
 				///////////////////////////////////////////
 				//Once the closest color for that parity is discovered it is 
 				//saved to the cache for faster reference in the future
@@ -278,7 +343,11 @@ unsigned char *hideMessage(struct RGBQUAD p[256], unsigned char *cvrImg, unsigne
 				///////////////////////////////////////////
 				
 				//The pixel's value is then assigned to the new index
-				cvrImg[pixel] = pIndex[i];
+				//and its page marked if that changed it
+				if(cvrImg[pixel] != pIndex[i]){
+					cvrImg[pixel] = pIndex[i];
+					dirty->page[(dirty->offset + pixel) / dirty->pageSize] = 1;
+				}
 				binIndex++;
 				pixel++;
 				break;
@@ -375,18 +444,96 @@ unsigned char *convertToBinary (char *fileName, int *size){
 }
 
 /***************** writeFile ****************
- * Purpose: Currently takes the information of
- * 	    a provided bitmap image and writes to
- * 	    a new file.
+ * Purpose: Writes the bitmap that carries the
+ * 	    payload to 'outfile.bmp'.
  *
- * 	    Needs to be adjusted to write to file
- * 	    the bitmap that carries the payload.
+ * 	    The cover is cloned first, so only the
+ * 	    pages marked in the dirty map need to be
+ * 	    written with pwrite. The clone is cut to
+ * 	    the same length the full write gives. If
+ * 	    the cover cannot be cloned the whole
+ * 	    bitmap is written out.
  * 
  ********************************************/
-void writeFile( struct RGBQUAD c[256],
+void writeFile( char *cover,
+		struct RGBQUAD c[256],
 		struct BITMAPFILEHEADER bmpFileHeader,
 		struct BITMAPINFOHEADER bmpInfoHeader,
-		unsigned char *bmpData){
+		unsigned char *bmpData,
+		struct DIRTYMAP *dirty){
+
+	int fd = -1;
+	struct stat statOut;
+	if(cloneCover(cover, "outfile.bmp") == 0){
+		fd = open("outfile.bmp", O_WRONLY);
+		if(fd < 0){
+			fprintf(stderr, "Failed to Open output file\n");
+			exit(-1);
+		}
+		/* a clone without the whole header and palette is no use */
+		if(fstat(fd, &statOut) != 0 || statOut.st_size < 0 || 
+		   (unsigned int) statOut.st_size < dirty->offset){
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if(fd >= 0){
+		/*
+		 * cut the clone to the length the full write would
+		 * give, dropping any bytes the cover had after the
+		 * pixel data.
+		 */
+		unsigned int n, from, to, end, cloned;
+		ssize_t written;
+		end = dirty->offset + bmpInfoHeader.biSizeImage;
+		cloned = (unsigned int) statOut.st_size < end ? (unsigned int) statOut.st_size : end;
+		if(ftruncate(fd, end) != 0){
+			fprintf(stderr, "Failed to size output file\n");
+			exit(-1);
+		}
+
+		/*
+		 * write each run of dirty pages, the first and last
+		 * page are cut down to the pixel data since the
+		 * headers and palette are already in the clone.
+		 * A cover shorter than its header says is missing
+		 * the pixels past the cloned length, that run is
+		 * written last.
+		 */
+		n = 0;
+		while(n <= dirty->pages){
+			if(n == dirty->pages){
+				from = cloned;
+				to = end;
+				n++;
+			} else if(!dirty->page[n]){
+				n++;
+				continue;
+			} else {
+				from = n * dirty->pageSize;
+				while(n < dirty->pages && dirty->page[n])
+					n++;
+				to = n * dirty->pageSize;
+			}
+
+			if(from < dirty->offset)
+				from = dirty->offset;
+			if(to > end)
+				to = end;
+
+			while(from < to){
+				written = pwrite(fd, bmpData + (from - dirty->offset), to - from, from);
+				if(written <= 0){
+					fprintf(stderr, "Failed to write output file\n");
+					exit(-1);
+				}
+				from += written;
+			}
+		}
+		close(fd);
+		return;
+	}
 
 	FILE *out;
 	out = fopen("outfile.bmp", "wb");
@@ -407,6 +554,64 @@ void writeFile( struct RGBQUAD c[256],
 	fclose(out);
 }
 
+/***************** cloneCover ****************
+ * Purpose: Makes outName a copy of the cover
+ * 	    image without reading it into memory.
+ *
+ * 	    A FICLONE reflink shares the cover's
+ * 	    blocks, so only the pages written later
+ * 	    get copied. Filesystems without reflinks
+ * 	    fall back to copy_file_range, which
+ * 	    copies inside the kernel.
+ *
+ * 	    Returns 0 on success and -1 if the cover
+ * 	    could not be copied this way.
+ *********************************************/
+int cloneCover(char *cover, char *outName){
+	struct stat statCover, statOut;
+	if(stat(cover, &statCover) != 0)
+		return -1;
+
+	/* hiding in place, the output already is the cover */
+	if(stat(outName, &statOut) == 0 && 
+	   statOut.st_dev == statCover.st_dev && statOut.st_ino == statCover.st_ino)
+		return 0;
+
+	int in, out;
+	in = open(cover, O_RDONLY);
+	if(in < 0)
+		return -1;
+	out = open(outName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(out < 0){
+		close(in);
+		return -1;
+	}
+
+	int result = -1;
+#ifdef FICLONE
+	if(ioctl(out, FICLONE, in) == 0)
+		result = 0;
+#endif
+#ifdef __linux__
+	if(result != 0){
+		off_t left = statCover.st_size;
+		ssize_t copied;
+		while(left > 0){
+			copied = copy_file_range(in, NULL, out, NULL, left, 0);
+			if(copied <= 0)
+				break;
+			left -= copied;
+		}
+		if(left == 0)
+			result = 0;
+	}
+#endif
+
+	close(in);
+	close(out);
+	return result;
+}
+
 /************************ loadBitMap *****************************
  * Purpose: Opens provided bitmap cover image, and extracts
  * 	    the file header, bitmap information header, color
@@ -414,10 +619,16 @@ void writeFile( struct RGBQUAD c[256],
  *
  * 	    The image data will be required to help calculation the 
  * 	    color distance for hiding the payload.
+ *
+ * 	    Also sets up the palette lookup tables. If the palette
+ * 	    is one of the standard palettes in palettes.c the finished
+ * 	    tables are copied in, otherwise only the parity is filled
+ * 	    in and hideMessage() works out the closest colors itself.
  *******************************************************************/
 unsigned char *loadBitMap(char *filename, struct RGBQUAD c[256], 
 		struct BITMAPFILEHEADER *bmpFileHeader, 
-		struct BITMAPINFOHEADER *bmpInfoHeader){
+		struct BITMAPINFOHEADER *bmpInfoHeader,
+		struct PALETTETABLE *table){
 
 	FILE *fPtr;
 	fPtr = fopen(filename, "rb");
@@ -447,6 +658,32 @@ unsigned char *loadBitMap(char *filename, struct RGBQUAD c[256],
 	for(i = 0; i < 256; i++)
 		fread(&c[i], sizeof(struct RGBQUAD), 1, fPtr);
 
+	/* look for a precompiled table, hash first then the colors */
+	unsigned char rgb[256][3];
+	for(i = 0; i < 256; i++){
+		rgb[i][0] = c[i].RED;
+		rgb[i][1] = c[i].GRN;
+		rgb[i][2] = c[i].BLU;
+	}
+	unsigned int hash = paletteHash(rgb);
+	const struct STDPALETTE *std = NULL;
+	for(i = 0; i < stdPaletteCount; i++){
+		if(stdPalettes[i].hash == hash && memcmp(stdPalettes[i].rgb, rgb, sizeof(rgb)) == 0){
+			std = &stdPalettes[i];
+			break;
+		}
+	}
+
+	if(std != NULL){
+		printf("%s uses the %s palette, using precompiled tables\n", filename, std->name);
+		memcpy(table->nearest, std->nearest, sizeof(table->nearest));
+		memcpy(table->parity, std->parity, sizeof(table->parity));
+	} else {
+		memset(table->nearest, -1, sizeof(table->nearest));
+		for(i = 0; i < 256; i++)
+			table->parity[i] = (c[i].RED + c[i].GRN + c[i].BLU) % 2;
+	}
+
 	// read in image
 	unsigned char *bmpImg; // store image data
 	bmpImg = (unsigned char *) malloc(bmpInfoHeader->biSizeImage);
@@ -473,7 +710,7 @@ unsigned char *loadBitMap(char *filename, struct RGBQUAD c[256],
  * 	data to a file called 'recovered'
  *
  * ***************************************************************************/
-void extractPayload(unsigned char *bmpData, struct RGBQUAD p[256], int cvrSize){
+void extractPayload(unsigned char *bmpData, struct PALETTETABLE *table, int cvrSize){
 	srand((unsigned int) 76);
         int i, pixel, j;
         int binSize[32] = {0}; // zero set array
@@ -488,7 +725,7 @@ void extractPayload(unsigned char *bmpData, struct RGBQUAD p[256], int cvrSize){
 	 * read.
 	 */
         for(i = 0; i < 32; i++){
-                binSize[i] =  (p[ bmpData[pixel] ].RED + p[ bmpData[pixel] ].GRN + p[ bmpData[pixel] ].BLU )% 2;
+                binSize[i] = table->parity[ bmpData[pixel] ];
                 pixel++;
         }
 
@@ -532,12 +769,13 @@ void extractPayload(unsigned char *bmpData, struct RGBQUAD p[256], int cvrSize){
 	 * we use the RGB values in the palette entry, to get
 	 * our hidden bit.
 	 *
-	 * to get the parity bit,  R+G+B mod 2
+	 * to get the parity bit,  R+G+B mod 2, which loadBitMap()
+	 * has already worked out for each entry
 	 *
 	 * store the results
 	 */
         for(i = 0; i < size * 8; i++){
-                result[i] = (p[ bmpData[pixel] ].RED + p[ bmpData[pixel] ].GRN + p[ bmpData[pixel] ].BLU )% 2;
+                result[i] = table->parity[ bmpData[pixel] ];
                 pixel++;
         }
 
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include "palettes.h"
+
+/********************************************************************************
+ * 			    gentables.c
+ *
+ * Purpose:
+ * 	Build time generator for palettes.c. For each standard palette
+ * 	it works out the parity of every entry and the closest entry of
+ * 	each parity, the same answers hideMessage() would put in its
+ * 	cache, and prints them as constant data.
+ *
+ * 	The grayscale palette is built here. Other palettes are read from
+ * 	reference bitmaps saved by the tools that produce them, so the
+ * 	tables match real covers entry for entry. Each file given on the
+ * 	command line adds a palette named after the file, the Makefile
+ * 	passes every .bmp file in palettes/.
+ *
+ * 	Run by the Makefile as
+ * 		./gentables [palettes/name.bmp ...] > palettes.c
+ ********************************************************************************/
+
+/* the 20 static colors Windows reserves, first 10 and last 10 */
+static const unsigned char winLow[10][3] = {
+	{0x00, 0x00, 0x00}, {0x80, 0x00, 0x00}, {0x00, 0x80, 0x00}, {0x80, 0x80, 0x00},
+	{0x00, 0x00, 0x80}, {0x80, 0x00, 0x80}, {0x00, 0x80, 0x80}, {0xC0, 0xC0, 0xC0},
+	{0xC0, 0xDC, 0xC0}, {0xA6, 0xCA, 0xF0}
+};
+static const unsigned char winHigh[10][3] = {
+	{0xFF, 0xFB, 0xF0}, {0xA0, 0xA0, 0xA4}, {0x80, 0x80, 0x80}, {0xFF, 0x00, 0x00},
+	{0x00, 0xFF, 0x00}, {0xFF, 0xFF, 0x00}, {0x00, 0x00, 0xFF}, {0xFF, 0x00, 0xFF},
+	{0x00, 0xFF, 0xFF}, {0xFF, 0xFF, 0xFF}
+};
+
+static void grayPalette(unsigned char rgb[256][3]){
+	int i;
+	for(i = 0; i < 256; i++)
+		rgb[i][0] = rgb[i][1] = rgb[i][2] = i;
+}
+
+/*
+ * Reads the palette of an 8-bit reference bitmap. The headers are
+ * read byte by byte so the generator does not depend on the size of
+ * long on the build host. Exits if the file is not usable.
+ */
+static void readPalette(const char *filename, unsigned char rgb[256][3]){
+	FILE *fPtr;
+	unsigned char hdr[14 + 16], quad[4];
+	unsigned int biSize;
+	int i;
+
+	fPtr = fopen(filename, "rb");
+	if(fPtr == NULL){
+		fprintf(stderr, "Unable to open file %s\n", filename);
+		exit(-1);
+	}
+
+	/* file header, then biSize .. biBitCount of the info header */
+	if(fread(hdr, sizeof(hdr), 1, fPtr) != 1 || hdr[0] != 'B' || hdr[1] != 'M'){
+		fprintf(stderr, "%s is not a bmp image\n", filename);
+		exit(-1);
+	}
+	if(hdr[28] != 8 || hdr[29] != 0){
+		fprintf(stderr, "%s is not a 8-bit bmp image\n", filename);
+		exit(-1);
+	}
+	biSize = hdr[14] | hdr[15] << 8 | hdr[16] << 16 | (unsigned int) hdr[17] << 24;
+
+	/* the palette follows the info header as BLU, GRN, RED, RES */
+	fseek(fPtr, 14 + biSize, SEEK_SET);
+	for(i = 0; i < 256; i++){
+		if(fread(quad, sizeof(quad), 1, fPtr) != 1){
+			fprintf(stderr, "%s has a short palette\n", filename);
+			exit(-1);
+		}
+		rgb[i][0] = quad[2];
+		rgb[i][1] = quad[1];
+		rgb[i][2] = quad[0];
+	}
+	fclose(fPtr);
+}
+
+/*
+ * The Windows default palette keeps the 20 static colors at both
+ * ends, only the 236 entries between them come from the reference.
+ * A reference that disagrees is refused rather than trusted.
+ */
+static void checkWindowsPalette(const char *filename, unsigned char rgb[256][3]){
+	if(memcmp(rgb[0], winLow, sizeof(winLow)) != 0 ||
+	   memcmp(rgb[246], winHigh, sizeof(winHigh)) != 0){
+		fprintf(stderr, "%s does not have the Windows static colors at entries 0-9 and 246-255\n", filename);
+		exit(-1);
+	}
+}
+
+/* palettes/windows.bmp -> windows */
+static void paletteName(const char *filename, char *name, int size){
+	const char *base, *dot;
+	int len;
+
+	base = strrchr(filename, '/');
+	base = base == NULL ? filename : base + 1;
+	dot = strrchr(base, '.');
+	len = dot == NULL ? (int) strlen(base) : (int) (dot - base);
+	if(len >= size)
+		len = size - 1;
+	memcpy(name, base, len);
+	name[len] = '\0';
+}
+
+/*
+ * Fills nearest[][] and parity[] for a palette.
+ *
+ * hideMessage() sorts the entries by color distance, putting an
+ * entry in front of earlier entries at the same distance, and takes
+ * the first one with the wanted parity. Keeping the last entry seen
+ * at the smallest distance gives the same answer without the list.
+ */
+static void buildTables(unsigned char rgb[256][3], int nearest[256][2], unsigned char parity[256]){
+	int i, j, b;
+	double close, best[2];
+
+	for(i = 0; i < 256; i++)
+		parity[i] = (rgb[i][0] + rgb[i][1] + rgb[i][2]) % 2;
+
+	for(i = 0; i < 256; i++){
+		nearest[i][0] = nearest[i][1] = -1;
+		for(j = 0; j < 256; j++){
+			close = sqrt( pow(rgb[i][0] - rgb[j][0], 2) +
+				      pow(rgb[i][1] - rgb[j][1], 2) +
+				      pow(rgb[i][2] - rgb[j][2], 2) );
+			b = parity[j];
+			if(nearest[i][b] == -1 || close <= best[b]){
+				nearest[i][b] = j;
+				best[b] = close;
+			}
+		}
+	}
+}
+
+static void emitPalette(const char *name, unsigned char rgb[256][3]){
+	int nearest[256][2];
+	unsigned char parity[256];
+	int i;
+
+	buildTables(rgb, nearest, parity);
+
+	printf("\t{\n\t\t\"%s\",\n\t\t0x%08Xu,\n\t\t{\n", name, paletteHash(rgb));
+	for(i = 0; i < 256; i++)
+		printf("\t\t\t{0x%02X, 0x%02X, 0x%02X},\n", rgb[i][0], rgb[i][1], rgb[i][2]);
+	printf("\t\t},\n\t\t{\n");
+	for(i = 0; i < 256; i++)
+		printf("\t\t\t{%d, %d},\n", nearest[i][0], nearest[i][1]);
+	printf("\t\t},\n\t\t{");
+	for(i = 0; i < 256; i++)
+		printf("%s%d,", i % 32 == 0 ? "\n\t\t\t" : " ", parity[i]);
+	printf("\n\t\t}\n\t},\n");
+}
+
+int main(int argc, char *argv[]){
+	unsigned char rgb[256][3];
+	char name[64];
+	int i;
+
+	printf("/* generated by gentables, do not edit */\n\n");
+	printf("#include \"palettes.h\"\n\n");
+	printf("const struct STDPALETTE stdPalettes[] = {\n");
+
+	grayPalette(rgb);
+	emitPalette("grayscale", rgb);
+
+	for(i = 1; i < argc; i++){
+		readPalette(argv[i], rgb);
+		paletteName(argv[i], name, sizeof(name));
+		if(strcmp(name, "windows") == 0)
+			checkWindowsPalette(argv[i], rgb);
+		emitPalette(name, rgb);
+	}
+
+	printf("};\n\n");
+	printf("const int stdPaletteCount = sizeof(stdPalettes) / sizeof(stdPalettes[0]);\n");
+	return 0;
+}
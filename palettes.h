@@ -0,0 +1,47 @@
+#ifndef _palettes_h_
+#define _palettes_h_
+
+/********************************************************************************
+ * 			    palettes.h
+ *
+ * Purpose:
+ * 	Describes the standard palettes whose lookup tables are computed
+ * 	ahead of time by gentables and compiled into the program as
+ * 	palettes.c. When a cover image uses one of these palettes,
+ * 	loadBitMap() copies the finished tables instead of leaving
+ * 	hideMessage() to rebuild them from the color distances.
+ *
+ * 	nearest[i][b] is the closest palette entry to entry i whose
+ * 	parity, R+G+B mod 2, equals b. It is -1 if no entry has that
+ * 	parity. parity[i] is the parity of entry i.
+ ********************************************************************************/
+
+typedef struct STDPALETTE{
+	const char *name;		// reported by loadBitMap() on a match
+	unsigned int hash;		// paletteHash() of rgb
+	unsigned char rgb[256][3];	// RED, GRN, BLU of each entry
+	int nearest[256][2];
+	unsigned char parity[256];
+} STDPALETTE;
+
+extern const struct STDPALETTE stdPalettes[];
+extern const int stdPaletteCount;
+
+/*
+ * 32-bit FNV-1a over the RED, GRN and BLU bytes of each entry.
+ * The reserved byte is left out, so a palette matches no matter
+ * what the writing program stored there.
+ */
+static inline unsigned int paletteHash(unsigned char rgb[256][3]){
+	unsigned int hash = 2166136261u;
+	int i, j;
+	for(i = 0; i < 256; i++){
+		for(j = 0; j < 3; j++){
+			hash ^= rgb[i][j];
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
+
+#endif